@@ -0,0 +1,307 @@
+// allocation and collection microbenchmarks. each workload is a synthetic
+// mutator with a fixed seed, shaped after one of the assignment's test suites
+// (TS1-TS8: single or multiple frames, pointers only on the stack or also in
+// the heap, with or without aliasing). every workload runs once per heap size,
+// each run in a forked child, since the runtime can only be initialized once
+// per process. other CFLAT_GC_* variables are passed through, so the runs
+// compare collector modes too.
+//
+// build: g++ -O2 -fno-omit-frame-pointer -o gc-bench gc-bench.cc runtime.cc -lpthread
+// usage: gc-bench [-s scale] [-h heap words,...] [workload...]
+//
+// per run it prints allocations per second (wall clock, collections
+// included), the number of collections, the pause distribution and the words
+// copied; a heap too small for the workload shows up as out of memory.
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gc-harness.h"
+
+// xorshift64, so every run of a workload makes the same choices.
+static uint64_t rng_state;
+static uint64_t rng() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static uint64_t allocations;
+
+// every allocating line of the workloads is an allocation site of its own,
+// for CFLAT_GC_PRETENURE.
+enum alloc_site {
+  SITE_INT,
+  SITE_ALIASED_INT,
+  SITE_TREE_LEVEL,
+  SITE_TREE_LEAF,
+  SITE_TREE_NODE,
+  SITE_DAG_TABLE,
+  SITE_DAG_NODE,
+  SITE_FRAME_INT,
+  SITE_ALIASED_FRAME_INT,
+  SITE_ARRAY,
+  SITE_ARRAY_INT,
+  SITE_LIST_NODE,
+};
+
+static uintptr_t *alloc(uintptr_t header, size_t payload_words, alloc_site site) {
+  ++allocations;
+  return gc_alloc_site(header, payload_words, site);
+}
+
+static const uintptr_t INT_HEADER = gc_header_atomic_array(1);
+// {value, next}
+static const uintptr_t NODE_HEADER = gc_header_struct(2, 0x1);
+// {value, left, right}
+static const uintptr_t TREE_HEADER = gc_header_struct(3, 0x3);
+
+// TS1: short-lived ints, one root.
+static void run_ints(long scale) {
+  gc_harness_init(1, 1);
+  for (long i = 0; i < scale * 1000; ++i) {
+    uintptr_t *obj = alloc(INT_HEADER, 1, SITE_INT);
+    obj[0] = i;
+    gc_root(0, 0) = (uintptr_t)obj;
+  }
+}
+
+// TS2: short-lived ints, copied between roots.
+static void run_aliased_ints(long scale) {
+  gc_harness_init(1, 16);
+  for (long i = 0; i < scale * 1000; ++i) {
+    uintptr_t *obj = alloc(INT_HEADER, 1, SITE_ALIASED_INT);
+    obj[0] = i;
+    gc_root(0, rng() % 16) = (uintptr_t)obj;
+    gc_root(0, rng() % 16) = gc_root(0, rng() % 16);
+  }
+}
+
+// TS3: deep trees, built bottom-up through a pointer array of subtrees. the
+// previous tree stays live while the next one is built.
+static void run_trees(long scale) {
+  const size_t leaves = 1024;
+  gc_harness_init(1, 3);
+  for (long built = 0; built < scale * 1000; built += 2 * leaves - 1) {
+    gc_root(0, 2) = (uintptr_t)alloc(gc_header_ptr_array(leaves), leaves,
+                                     SITE_TREE_LEVEL);
+    for (size_t i = 0; i < leaves; ++i) {
+      uintptr_t *leaf = alloc(TREE_HEADER, 3, SITE_TREE_LEAF);
+      leaf[0] = i;
+      gc_store((uintptr_t*)gc_root(0, 2), i, (uintptr_t)leaf);
+    }
+    for (size_t width = leaves / 2; width > 0; width /= 2) {
+      for (size_t i = 0; i < width; ++i) {
+        uintptr_t *node = alloc(TREE_HEADER, 3, SITE_TREE_NODE);
+        uintptr_t *level = (uintptr_t*)gc_root(0, 2);
+        node[0] = width;
+        gc_store(node, 1, gc_load(level, 2 * i));
+        gc_store(node, 2, gc_load(level, 2 * i + 1));
+        gc_store(level, i, (uintptr_t)node);
+      }
+    }
+    gc_root(0, 1) = gc_root(0, 0);
+    gc_root(0, 0) = gc_load((uintptr_t*)gc_root(0, 2), 0);
+    gc_root(0, 2) = 0;
+  }
+}
+
+// TS4: heavy aliasing, a table of nodes that each point at up to two random
+// table entries, so the heap is a dag with many references per object. fewer
+// than one edge per node on average keeps the live set bounded.
+static void run_dag(long scale) {
+  const size_t slots = 1024;
+  gc_harness_init(1, 1);
+  gc_root(0, 0) = (uintptr_t)alloc(gc_header_ptr_array(slots), slots, SITE_DAG_TABLE);
+  for (long i = 0; i < scale * 1000; ++i) {
+    uintptr_t *node = alloc(TREE_HEADER, 3, SITE_DAG_NODE);
+    uintptr_t *table = (uintptr_t*)gc_root(0, 0);
+    node[0] = i;
+    if (rng() % 2 == 0) {
+      gc_store(node, 1, gc_load(table, rng() % slots));
+    }
+    if (rng() % 4 == 0) {
+      gc_store(node, 2, gc_load(table, rng() % slots));
+    }
+    gc_store(table, rng() % slots, (uintptr_t)node);
+  }
+}
+
+// TS5: ints spread over the roots of many frames.
+static void run_frames(long scale) {
+  const int frames = 64, roots = 4;
+  gc_harness_init(frames, roots);
+  for (long i = 0; i < scale * 1000; ++i) {
+    uintptr_t *obj = alloc(INT_HEADER, 1, SITE_FRAME_INT);
+    obj[0] = i;
+    gc_root(rng() % frames, rng() % roots) = (uintptr_t)obj;
+  }
+}
+
+// TS6: ints spread over many frames, copied between frames.
+static void run_aliased_frames(long scale) {
+  const int frames = 64, roots = 4;
+  gc_harness_init(frames, roots);
+  for (long i = 0; i < scale * 1000; ++i) {
+    uintptr_t *obj = alloc(INT_HEADER, 1, SITE_ALIASED_FRAME_INT);
+    obj[0] = i;
+    gc_root(rng() % frames, rng() % roots) = (uintptr_t)obj;
+    gc_root(rng() % frames, rng() % roots) = gc_root(rng() % frames, rng() % roots);
+  }
+}
+
+// TS7: wide pointer arrays of ints, one per frame, replaced now and then.
+static void run_arrays(long scale) {
+  const int frames = 16;
+  const size_t width = 256;
+  gc_harness_init(frames, 1);
+  for (long i = 0; i < scale * 1000; ++i) {
+    int k = rng() % frames;
+    if (!gc_root(k, 0) || rng() % 512 == 0) {
+      gc_root(k, 0) = (uintptr_t)alloc(gc_header_ptr_array(width), width, SITE_ARRAY);
+    }
+    uintptr_t *obj = alloc(INT_HEADER, 1, SITE_ARRAY_INT);
+    obj[0] = i;
+    gc_store((uintptr_t*)gc_root(k, 0), rng() % width, (uintptr_t)obj);
+  }
+}
+
+// TS8: long linked lists, one per frame, with roots in other frames pointing
+// into the middle of them. lists are dropped at random.
+static void run_lists(long scale) {
+  const int frames = 16;
+  gc_harness_init(frames, 2);
+  for (long i = 0; i < scale * 1000; ++i) {
+    int k = rng() % frames;
+    uintptr_t *node = alloc(NODE_HEADER, 2, SITE_LIST_NODE);
+    node[0] = i;
+    gc_store(node, 1, gc_root(k, 0));
+    gc_root(k, 0) = (uintptr_t)node;
+    if (rng() % 64 == 0) {
+      gc_root(rng() % frames, 1) = gc_root(k, 0);
+    }
+    if (rng() % 256 == 0) {
+      gc_root(k, 0) = 0;
+    }
+  }
+}
+
+struct workload {
+  const char *name;
+  const char *shape;
+  void (*run)(long scale);
+};
+
+static const workload workloads[] = {
+  {"ints", "TS1", run_ints},
+  {"aliased-ints", "TS2", run_aliased_ints},
+  {"trees", "TS3", run_trees},
+  {"dag", "TS4", run_dag},
+  {"frames", "TS5", run_frames},
+  {"aliased-frames", "TS6", run_aliased_frames},
+  {"arrays", "TS7", run_arrays},
+  {"lists", "TS8", run_lists},
+};
+
+// run `w` with a heap of `heap_words` in a child process and print its row.
+static void run_one(const workload &w, long scale, const std::string &heap_words) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the child's stdout only ever gets a panic message, which the parent
+    // reports on its own
+    close(fds[0]);
+    if (!freopen("/dev/null", "w", stdout)) { _exit(1); }
+    setenv("CFLAT_HEAP_WORDS", heap_words.c_str(), 1);
+    rng_state = 0x9E3779B97F4A7C15ull;
+    auto start = std::chrono::steady_clock::now();
+    w.run(scale);
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    _cflat_gc_stats_t stats;
+    _cflat_gc_stats(&stats);
+    char row[256];
+    int len = snprintf(row, sizeof(row),
+                       "%12.0f %8llu %10.1f %10.1f %10.1f %14llu\n",
+                       allocations / seconds,
+                       (unsigned long long)stats.collections,
+                       stats.p50_pause_ns / 1e3, stats.p99_pause_ns / 1e3,
+                       stats.max_pause_ns / 1e3,
+                       (unsigned long long)stats.words_copied);
+    if (write(fds[1], row, len) != len) { _exit(1); }
+    _exit(0);
+  }
+  close(fds[1]);
+  char row[256];
+  ssize_t len = read(fds[0], row, sizeof(row) - 1);
+  close(fds[0]);
+  waitpid(pid, nullptr, 0);
+  printf("%-15s %-4s %10s ", w.name, w.shape, heap_words.c_str());
+  if (len > 0) {
+    row[len] = '\0';
+    fputs(row, stdout);
+  } else {
+    printf("%12s\n", "out of memory");
+  }
+}
+
+int main(int argc, char **argv) {
+  long scale = 1000;
+  std::vector<std::string> heaps = {"65536", "1048576", "16777216"};
+  std::vector<const workload*> selected;
+
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      scale = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+      heaps.clear();
+      std::string list = argv[++i];
+      size_t pos = 0;
+      while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        heaps.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+      }
+    } else {
+      const workload *found = nullptr;
+      for (const workload &w : workloads) {
+        if (strcmp(argv[i], w.name) == 0) found = &w;
+      }
+      if (!found) {
+        fprintf(stderr, "usage: %s [-s scale] [-h heap words,...] [workload...]\n"
+                        "workloads:", argv[0]);
+        for (const workload &w : workloads) fprintf(stderr, " %s", w.name);
+        fprintf(stderr, "\n");
+        return 2;
+      }
+      selected.push_back(found);
+    }
+  }
+  if (selected.empty()) {
+    for (const workload &w : workloads) selected.push_back(&w);
+  }
+
+  printf("%-15s %-4s %10s %12s %8s %10s %10s %10s %14s\n", "workload", "ts",
+         "heap", "allocs/s", "gcs", "p50 us", "p99 us", "max us", "words copied");
+  for (const workload *w : selected) {
+    for (const std::string &heap_words : heaps) {
+      run_one(*w, scale, heap_words);
+    }
+  }
+  return 0;
+}
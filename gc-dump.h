@@ -0,0 +1,39 @@
+// heap snapshots, shared by the runtime (runtime.cc), which writes them, and
+// the offline summary tool (gc-heap-summary.cc), which reads them.
+//
+// a snapshot is taken right after a full collection, when the heap holds
+// nothing but the objects it found live (and, in incremental mode, those
+// allocated while it ran). setting `CFLAT_GC_DUMP_AT` to n makes collection n
+// (counting from 1) a full one and takes a snapshot after it; a program can
+// also call `_cflat_heap_dump()` (see runtime.h) at any point. snapshots are
+// appended to the file named by `CFLAT_GC_DUMP_FILE` (default
+// `cflat-heap.dump`), which is truncated when the program takes its first one.
+//
+// binary format: the 8 bytes of `GC_DUMP_MAGIC`, then a sequence of records.
+// each record is one byte holding its `gc_dump_record` code followed by
+// unsigned LEB128 varints (see gc-log.h), as listed below. objects are
+// identified by the value of the program's pointers to them (the address of
+// their first data word) divided by 8. with more than one collector thread
+// (`CFLAT_GC_THREADS`) the words left over at the end of the threads' copy
+// chunks are in the snapshot too, as unreachable atomic arrays, as are the
+// unused ends of the allocation buffers of multi-threaded mutators
+// (`CFLAT_GC_MUTATORS`), whose stacks are numbered one after the other, the
+// dumping thread's first.
+
+#ifndef CFLAT_GC_DUMP_H
+#define CFLAT_GC_DUMP_H
+
+#include <cstdint>
+
+static const char GC_DUMP_MAGIC[8] = {'C', 'F', 'H', 'E', 'A', 'P', 'D', 1};
+
+// record codes. the comment after each one lists its fields.
+enum gc_dump_record : uint8_t {
+  GC_DUMP_SNAPSHOT = 1, // collection number
+  GC_DUMP_ROOT,         // frame index (from the top of the stack), root offset, object
+  GC_DUMP_OBJECT,       // object, header, payload words, reference count,
+                        // then that many objects it points to
+  GC_DUMP_END,          // object count, total words (headers included)
+};
+
+#endif // CFLAT_GC_DUMP_H
@@ -0,0 +1,125 @@
+// harness for driving the runtime (runtime.cc) from C++ instead of compiled
+// cflat code, used by gc-bench.cc and gc-replay.cc. it builds a fake stack of
+// cflat frames in static memory (old %rbp at 0(%rbp), a return address slot
+// at 8(%rbp), root count at -8(%rbp), root i at frame - 2 - i) and calls into
+// the runtime with %rbp pointing at the top frame, so the collector scans
+// exactly the roots the driver keeps there.
+//
+// the driver must never hold a heap pointer across a call to `gc_alloc`:
+// collections move objects, and only the roots (and heap fields) get updated.
+// since the driver can store into the roots of any frame, not just the top
+// one, it can't be used with `CFLAT_GC_WATERMARK`.
+//
+// this header defines an asm symbol, so include it in exactly one translation
+// unit per program. build with -fno-omit-frame-pointer.
+
+#ifndef CFLAT_GC_HARNESS_H
+#define CFLAT_GC_HARNESS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#include "runtime.h"
+
+extern "C" void _cflat_init_gc();
+extern "C" void _cflat_write_barrier(void *obj, void *value);
+
+// call fn(arg, arg2) with %rbp set to `frame`, so the runtime sees `frame` as
+// the frame of its caller. `fn` must be the runtime entry point itself: a
+// wrapper would put its own frame between the runtime and `frame`.
+extern "C" uint64_t gc_harness_call(uintptr_t *frame, const void *fn,
+                                    uint64_t arg, uint64_t arg2 = 0);
+asm(R"(
+  .text
+  .globl gc_harness_call
+gc_harness_call:
+  push %rbp
+  mov %rdi, %rbp
+  mov %rsi, %rax
+  mov %rdx, %rdi
+  mov %rcx, %rsi
+  call *%rax
+  pop %rbp
+  ret
+)");
+
+static const int GC_HARNESS_MAX_FRAMES = 256;
+static const int GC_HARNESS_STACK_WORDS = 1 << 16;
+
+static uintptr_t gc_harness_stack[GC_HARNESS_STACK_WORDS];
+static uintptr_t *gc_harness_frames[GC_HARNESS_MAX_FRAMES];
+static int gc_harness_num_frames;
+
+// object headers, in the encodings the collector decodes (see gc-log.h).
+inline uintptr_t gc_header_atomic_array(size_t len) { return (len << 3) | 2; }
+inline uintptr_t gc_header_ptr_array(size_t len) { return (len << 3) | 6; }
+inline uintptr_t gc_header_weak(size_t len) { return (len << 3) | 5; }
+// struct of `size` fields where bit i of `ptr_bits` marks field i + 1 as a
+// pointer (TS3 encoding: field 0 is never a pointer, at most 5 fields).
+inline uintptr_t gc_header_struct(size_t size, uintptr_t ptr_bits) {
+  return ((size << 5) | ptr_bits) << 3;
+}
+
+// build `num_frames` frames of `roots_per_frame` zeroed roots each (frame 0
+// stands in for `main`) and initialize the runtime from the environment.
+inline void gc_harness_init(int num_frames, int roots_per_frame) {
+  if (num_frames < 1 || num_frames > GC_HARNESS_MAX_FRAMES ||
+      (size_t)num_frames * (roots_per_frame + 3) + 64 > GC_HARNESS_STACK_WORDS) {
+    abort();
+  }
+  uintptr_t *base = gc_harness_stack + GC_HARNESS_STACK_WORDS - 8;
+  uintptr_t *frame = base - 8;
+  for (int k = 0; k < num_frames; ++k) {
+    gc_harness_frames[k] = frame;
+    frame[0] = k == 0 ? (uintptr_t)base : (uintptr_t)gc_harness_frames[k - 1];
+    frame[-1] = roots_per_frame;
+    for (int i = 0; i < roots_per_frame; ++i) {
+      frame[-2 - i] = 0;
+    }
+    frame[1] = 0;
+    frame -= roots_per_frame + 3;
+  }
+  gc_harness_num_frames = num_frames;
+  gc_harness_call(gc_harness_frames[0], (const void*)_cflat_init_gc, 0);
+}
+
+// root `i` of frame `k` (0 is the oldest frame).
+inline uintptr_t &gc_root(int k, int i) {
+  return gc_harness_frames[k][-2 - i];
+}
+
+// allocate an object with `payload_words` words after its header, from the
+// top frame, and return the pointer to its first data word.
+inline uintptr_t *gc_alloc(uintptr_t header, size_t payload_words) {
+  uintptr_t *frame = gc_harness_frames[gc_harness_num_frames - 1];
+  uintptr_t *obj = (uintptr_t*)gc_harness_call(frame, (const void*)_cflat_alloc,
+                                               payload_words + 1);
+  obj[0] = header;
+  return obj + 1;
+}
+
+// the same, for allocation site `site` (see `CFLAT_GC_PRETENURE`).
+inline uintptr_t *gc_alloc_site(uintptr_t header, size_t payload_words,
+                                uint64_t site) {
+  uintptr_t *frame = gc_harness_frames[gc_harness_num_frames - 1];
+  uintptr_t *obj = (uintptr_t*)gc_harness_call(frame, (const void*)_cflat_alloc_site,
+                                               payload_words + 1, site);
+  obj[0] = header;
+  return obj + 1;
+}
+
+// load pointer field `i` of `obj`, with the read barrier that the
+// incremental mode needs.
+inline uintptr_t gc_load(uintptr_t *obj, size_t i) {
+  return (uintptr_t)_cflat_read_barrier_inline((void*)obj[i]);
+}
+
+// store `value` into field `i` of `obj`, with the write barrier that the
+// generational mode needs.
+inline void gc_store(uintptr_t *obj, size_t i, uintptr_t value) {
+  obj[i] = value;
+  _cflat_write_barrier(obj, (void*)value);
+}
+
+#endif // CFLAT_GC_HARNESS_H
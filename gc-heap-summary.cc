@@ -0,0 +1,298 @@
+// offline summary of heap snapshots (`CFLAT_GC_DUMP_AT` or `_cflat_heap_dump`,
+// see gc-dump.h). for every snapshot in the file it prints a histogram of the
+// objects by kind: how many there are, the words they take themselves, and
+// the words they retain, i.e. the words that would become garbage if every
+// object of that kind were dropped. retained sizes come from the dominator
+// tree of the object graph, rooted at the stack roots, so the kinds at the
+// top of the list are where cutting references frees the most memory.
+// pointer arrays, atomic arrays and weak references count as one kind each,
+// whatever their length. weak references don't retain their targets, so
+// their fields aren't edges of the graph.
+//
+// build: g++ -O2 -o gc-heap-summary gc-heap-summary.cc
+// usage: gc-heap-summary [dump file]   (reads standard input if no file given)
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "gc-dump.h"
+#include "gc-log.h"
+
+// text sink for gc_log_format_header, collecting into a string.
+struct string_text {
+  std::string text;
+  void str(const char *s) { text += s; }
+  void num(int64_t n) { text += std::to_string(n); }
+};
+
+struct object {
+  uint64_t id;
+  uint64_t header;
+  uint64_t words;                // header included
+  std::vector<uint64_t> refs;    // object ids
+};
+
+struct snapshot {
+  uint64_t collection = 0;
+  std::vector<uint64_t> roots;   // object ids
+  std::vector<object> objects;
+};
+
+struct kind_stats {
+  uint64_t objects = 0;
+  uint64_t words = 0;
+  uint64_t retained = 0;
+};
+
+// the name objects of `header` are counted under.
+static std::string kind_name(uint64_t header) {
+  uint64_t tag = header & 0x7;
+  if (tag == 2) return "[Array, ptrs = false]";
+  if (tag == 6) return "[Array, ptrs = true]";
+  if (tag == 5) return "[Weak]";
+  string_text out;
+  gc_log_format_header(out, header);
+  return out.text;
+}
+
+// node 0 is a virtual root pointing at every stack root; object i is node
+// i + 1. `idom` gets the immediate dominator of every node reachable from
+// node 0 (-1 for the others), and `order` those nodes in reverse postorder,
+// using the iterative algorithm of cooper, harvey and kennedy.
+static void dominators(const std::vector<std::vector<int>> &succs,
+                       std::vector<int> &idom, std::vector<int> &order) {
+  size_t n = succs.size();
+  std::vector<int> post_index(n, -1);
+  std::vector<bool> visited(n, false);
+  std::vector<std::pair<int, size_t>> stack = {{0, 0}};
+  visited[0] = true;
+  while (!stack.empty()) {
+    auto &[node, next] = stack.back();
+    if (next < succs[node].size()) {
+      int succ = succs[node][next++];
+      if (!visited[succ]) {
+        visited[succ] = true;
+        stack.push_back({succ, 0});
+      }
+    } else {
+      post_index[node] = order.size();
+      order.push_back(node);
+      stack.pop_back();
+    }
+  }
+  std::reverse(order.begin(), order.end());
+
+  std::vector<std::vector<int>> preds(n);
+  for (size_t v = 0; v < n; ++v) {
+    if (post_index[v] < 0) continue;
+    for (int succ : succs[v]) preds[succ].push_back(v);
+  }
+  idom.assign(n, -1);
+  idom[0] = 0;
+  auto intersect = [&](int a, int b) {
+    while (a != b) {
+      while (post_index[a] < post_index[b]) a = idom[a];
+      while (post_index[b] < post_index[a]) b = idom[b];
+    }
+    return a;
+  };
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < order.size(); ++i) {
+      int v = order[i];
+      int new_idom = -1;
+      for (int pred : preds[v]) {
+        if (idom[pred] < 0) continue;
+        new_idom = new_idom < 0 ? pred : intersect(pred, new_idom);
+      }
+      if (idom[v] != new_idom) {
+        idom[v] = new_idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+static void summarize(const snapshot &snap) {
+  size_t n = snap.objects.size() + 1;
+  std::unordered_map<uint64_t, int> node_of;
+  for (size_t i = 0; i < snap.objects.size(); ++i) {
+    node_of[snap.objects[i].id] = i + 1;
+  }
+  std::vector<std::vector<int>> succs(n);
+  for (uint64_t root : snap.roots) {
+    auto it = node_of.find(root);
+    if (it != node_of.end()) succs[0].push_back(it->second);
+  }
+  for (size_t i = 0; i < snap.objects.size(); ++i) {
+    for (uint64_t ref : snap.objects[i].refs) {
+      auto it = node_of.find(ref);
+      if (it != node_of.end()) succs[i + 1].push_back(it->second);
+    }
+  }
+
+  std::vector<int> idom, order;
+  dominators(succs, idom, order);
+
+  // retained sizes, children before their dominators
+  std::vector<uint64_t> retained(n, 0);
+  for (size_t i = order.size(); i-- > 1;) {
+    int v = order[i];
+    retained[v] += snap.objects[v - 1].words;
+    retained[idom[v]] += retained[v];
+  }
+
+  std::vector<std::string> kind_of(n);
+  std::map<std::string, kind_stats> kinds;
+  uint64_t total_words = 0, unreachable = 0, unreachable_words = 0;
+  for (size_t v = 1; v < n; ++v) {
+    const object &obj = snap.objects[v - 1];
+    kind_of[v] = kind_name(obj.header);
+    kind_stats &stats = kinds[kind_of[v]];
+    stats.objects++;
+    stats.words += obj.words;
+    total_words += obj.words;
+    if (idom[v] < 0) {
+      unreachable++;
+      unreachable_words += obj.words;
+    }
+  }
+
+  // a kind retains what its objects dominate, not counting the objects
+  // dominated by another object of the same kind twice: walk the dominator
+  // tree keeping count of the kinds of the nodes above the current one
+  std::vector<std::vector<int>> children(n);
+  for (size_t i = 1; i < order.size(); ++i) {
+    children[idom[order[i]]].push_back(order[i]);
+  }
+  std::map<std::string, int> active;
+  std::vector<std::pair<int, bool>> walk = {{0, false}};
+  while (!walk.empty()) {
+    auto [v, done] = walk.back();
+    walk.pop_back();
+    if (done) {
+      active[kind_of[v]]--;
+      continue;
+    }
+    if (v != 0) {
+      if (active[kind_of[v]] == 0) kinds[kind_of[v]].retained += retained[v];
+      active[kind_of[v]]++;
+      walk.push_back({v, true});
+    }
+    for (int child : children[v]) walk.push_back({child, false});
+  }
+
+  std::vector<std::pair<std::string, kind_stats>> rows(kinds.begin(), kinds.end());
+  std::sort(rows.begin(), rows.end(), [](const auto &a, const auto &b) {
+    return a.second.retained != b.second.retained
+           ? a.second.retained > b.second.retained
+           : a.second.words > b.second.words;
+  });
+  printf("snapshot after collection %llu: %zu objects, %llu words, %zu roots\n",
+         (unsigned long long)snap.collection, snap.objects.size(),
+         (unsigned long long)total_words, snap.roots.size());
+  if (unreachable > 0) {
+    printf("  (%llu objects, %llu words not reachable from the roots)\n",
+           (unsigned long long)unreachable, (unsigned long long)unreachable_words);
+  }
+  printf("  %10s %12s %12s  %s\n", "objects", "words", "retained", "kind");
+  for (const auto &[name, stats] : rows) {
+    printf("  %10llu %12llu %12llu  %s\n", (unsigned long long)stats.objects,
+           (unsigned long long)stats.words, (unsigned long long)stats.retained,
+           name.c_str());
+  }
+}
+
+// read all of `file` into `data`; returns false on error.
+static bool read_all(FILE *file, std::vector<uint8_t> &data) {
+  uint8_t chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  return !ferror(file);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [dump file]\n", argv[0]);
+    return 2;
+  }
+  FILE *file = argc == 2 ? fopen(argv[1], "rb") : stdin;
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  std::vector<uint8_t> data;
+  if (!read_all(file, data)) {
+    perror("read");
+    return 1;
+  }
+  if (data.size() < sizeof(GC_DUMP_MAGIC) ||
+      memcmp(data.data(), GC_DUMP_MAGIC, sizeof(GC_DUMP_MAGIC)) != 0) {
+    fprintf(stderr, "not a cflat heap dump\n");
+    return 1;
+  }
+
+  const uint8_t *in = data.data() + sizeof(GC_DUMP_MAGIC);
+  const uint8_t *end = data.data() + data.size();
+  auto get = [&](uint64_t &value) { return gc_log_get_varint(&in, end, &value); };
+  snapshot snap;
+  bool in_snapshot = false;
+  while (in < end) {
+    uint8_t record = *in++;
+    bool ok = true;
+    uint64_t a = 0, b = 0, c = 0;
+    switch (record) {
+    case GC_DUMP_SNAPSHOT:
+      ok = !in_snapshot && get(a);
+      snap = snapshot();
+      snap.collection = a;
+      in_snapshot = true;
+      break;
+    case GC_DUMP_ROOT:
+      ok = in_snapshot && get(a) && get(b) && get(c);
+      snap.roots.push_back(c);
+      break;
+    case GC_DUMP_OBJECT: {
+      object obj;
+      uint64_t payload = 0, count = 0;
+      ok = in_snapshot && get(obj.id) && get(obj.header) && get(payload) &&
+           get(count) && count <= payload;
+      obj.words = payload + 1;
+      for (uint64_t i = 0; ok && i < count; ++i) {
+        ok = get(a);
+        obj.refs.push_back(a);
+      }
+      snap.objects.push_back(std::move(obj));
+      break;
+    }
+    case GC_DUMP_END:
+      ok = in_snapshot && get(a) && get(b) && a == snap.objects.size();
+      if (ok) summarize(snap);
+      in_snapshot = false;
+      break;
+    default:
+      fprintf(stderr, "bad record code %u at offset %zu\n", record,
+              (size_t)(in - 1 - data.data()));
+      return 1;
+    }
+    if (!ok) {
+      fprintf(stderr, "truncated or corrupt dump\n");
+      return 1;
+    }
+  }
+  if (in_snapshot) {
+    fprintf(stderr, "truncated dump\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,88 @@
+// offline decoder for binary gc logs (`CFLAT_GC_LOG=bin`, see gc-log.h).
+// prints the log in the same text format that `CFLAT_GC_LOG=1` produces, so
+// the result can be compared against a reference log with `diff -wB`.
+//
+// build: g++ -O2 -o gc-log-decode gc-log-decode.cc
+// usage: gc-log-decode [log file]   (reads standard input if no file given)
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "gc-log.h"
+
+// text sink for gc_log_format, writing to stdout.
+struct stdout_text {
+  void str(const char *s) { fputs(s, stdout); }
+  void num(int64_t n) { printf("%lld", (long long)n); }
+};
+
+// read all of `file` into `data`; returns false on error.
+static bool read_all(FILE *file, std::vector<uint8_t> &data) {
+  uint8_t chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  return !ferror(file);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 2) {
+    fprintf(stderr, "usage: %s [log file]\n", argv[0]);
+    return 2;
+  }
+  FILE *file = argc == 2 ? fopen(argv[1], "rb") : stdin;
+  if (!file) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  std::vector<uint8_t> data;
+  if (!read_all(file, data)) {
+    perror("read");
+    return 1;
+  }
+  if (data.size() < sizeof(GC_LOG_MAGIC) ||
+      memcmp(data.data(), GC_LOG_MAGIC, sizeof(GC_LOG_MAGIC)) != 0) {
+    fprintf(stderr, "not a binary cflat gc log\n");
+    return 1;
+  }
+
+  const uint8_t *in = data.data() + sizeof(GC_LOG_MAGIC);
+  const uint8_t *end = data.data() + data.size();
+  stdout_text out;
+  while (in < end) {
+    uint8_t event = *in++;
+    if (event == 0 || event >= GC_EV_COUNT) {
+      fprintf(stderr, "bad event code %u at offset %zu\n", event,
+              (size_t)(in - 1 - data.data()));
+      return 1;
+    }
+
+    int64_t args[3] = {0, 0, 0};
+    std::string message;
+    bool ok = true;
+    for (int i = 0; ok && i < gc_log_arity[event]; ++i) {
+      uint64_t value;
+      ok = gc_log_get_varint(&in, end, &value);
+      args[i] = (int64_t)value;
+    }
+    if (ok && event == GC_EV_PANIC) {
+      uint64_t len;
+      ok = gc_log_get_varint(&in, end, &len) && len <= (uint64_t)(end - in);
+      if (ok) {
+        message.assign((const char *)in, len);
+        in += len;
+      }
+    }
+    if (!ok) {
+      fprintf(stderr, "truncated log\n");
+      return 1;
+    }
+    gc_log_format(out, event, args, message.c_str());
+  }
+  return 0;
+}
@@ -0,0 +1,300 @@
+// gc log events, shared by the runtime (runtime.cc), which emits them, and the
+// offline decoder (gc-log-decode.cc), which turns a binary log back into text.
+//
+// with `CFLAT_GC_LOG=1` the runtime formats every event as text straight into
+// its output buffer. with `CFLAT_GC_LOG=bin` it writes the events in the
+// compact binary format below to the file named by `CFLAT_GC_LOG_FILE`
+// (default `cflat-gc.log`), and gc-log-decode prints the same text that
+// `CFLAT_GC_LOG=1` would have printed.
+//
+// binary format: the 8 bytes of `GC_LOG_MAGIC`, then a sequence of events.
+// each event is one byte holding its `gc_log_event` code followed by
+// `gc_log_arity[code]` arguments, each an unsigned LEB128 varint of the
+// argument's 64-bit two's complement value. `GC_EV_PANIC` is followed by a
+// varint byte count and the message bytes instead.
+
+#ifndef CFLAT_GC_LOG_H
+#define CFLAT_GC_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+
+static const char GC_LOG_MAGIC[8] = {'C', 'F', 'G', 'C', 'L', 'O', 'G', 1};
+
+// event codes. the comment after each one lists its arguments.
+enum gc_log_event : uint8_t {
+  GC_EV_INIT = 1,       // heap words
+  GC_EV_INIT_NURSERY,   // nursery words
+  GC_EV_ALLOC,          // requested words
+  GC_EV_ALLOC_RETRY,    // requested words
+  GC_EV_ALLOC_OK,       //
+  GC_EV_ALLOC_OLD,      //
+  GC_EV_ALLOC_GC,       //
+  GC_EV_MINOR,          //
+  GC_EV_MAJOR,          //
+  GC_EV_FRAME,          // frame index, root count
+  GC_EV_ROOT,           // root offset
+  GC_EV_REMSET,         // remembered objects
+  GC_EV_FORWARD,        // old relative address, new relative address
+  GC_EV_COPY,           // old relative address, header, new relative address
+  GC_EV_SCAN,           //
+  GC_EV_SCAN_OBJECT,    // header
+  GC_EV_SCAN_NEXT,      // object words
+  GC_EV_PROMOTED,       // promoted words, old generation words
+  GC_EV_SWAP,           // live words
+  GC_EV_PANIC,          // (message)
+  GC_EV_RESIZE,         // new heap words
+  GC_EV_ALLOC_LARGE,    //
+  GC_EV_LARGE_SWEEP,    // freed large objects, live large object words
+  GC_EV_COMPACT,        //
+  GC_EV_COMPACTED,      // live words
+  GC_EV_COPYING,        //
+  GC_EV_COUNT
+};
+
+static const uint8_t gc_log_arity[GC_EV_COUNT] = {
+  0, 1, 1, 1, 1, 0, 0, 0, 0, 0, 2, 1, 1, 2, 3, 0, 1, 1, 2, 1, 0, 1, 0,
+  2, 0, 1, 0,
+};
+
+// append `value` to `out` as an unsigned LEB128 varint; returns the number of
+// bytes written (at most 10).
+inline size_t gc_log_put_varint(uint8_t *out, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = uint8_t(value) | 0x80;
+    value >>= 7;
+  }
+  out[n++] = uint8_t(value);
+  return n;
+}
+
+// read a varint from [*in, end), advancing *in; returns false if truncated.
+inline bool gc_log_get_varint(const uint8_t **in, const uint8_t *end,
+                              uint64_t *value) {
+  uint64_t result = 0;
+  for (int shift = 0; *in < end && shift < 64; shift += 7) {
+    uint8_t byte = *(*in)++;
+    result |= uint64_t(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+// text formatting. `Out` needs `str(const char*)` and `num(int64_t)`.
+
+// print a heap object header, e.g. [Array, len = 1, ptrs = false]. tag values
+// are those of TAG_STRUCT_ATOMIC (0), TAG_ARRAY_ATOMIC (2), TAG_STRUCT_PTRS (4),
+// TAG_WEAK (5) and TAG_ARRAY_PTRS (6) in runtime.cc.
+template <class Out>
+void gc_log_format_header(Out &out, uintptr_t header) {
+  long len = header >> 3;
+  long tag = header & 0x7;
+
+  if (tag == 2 || tag == 6) {
+    out.str("[Array, len = ");
+    out.num(len);
+    out.str(tag == 6 ? ", ptrs = true]" : ", ptrs = false]");
+  } else if (tag == 5) {
+    out.str("[Weak, len = ");
+    out.num(len);
+    out.str("]");
+  } else if (tag == 4) {
+    // Tag 4 is used for structs with pointers (TS4 encoding)
+    long size = len >> 5;
+    long ptr_bitmap = len & 0x1F;
+
+    out.str("[Struct, size = ");
+    out.num(size);
+    if (ptr_bitmap == 0) {
+      out.str(", ptr offsets = none]");
+    } else {
+      // TS4: bitmap value N means first N+1 fields are pointers
+      out.str(", ptr offsets =");
+      size_t num_ptr_fields = ptr_bitmap + 1;
+      for (size_t i = 0; i < num_ptr_fields && i < 5; ++i) {
+        out.str(" ");
+        out.num(i);
+      }
+      out.str("]");
+    }
+  } else if (tag == 0) {
+    // Tag 0: could be atomic struct OR struct with pointers (TS3 encoding)
+    long size = len >> 5;
+    long ptr_bitmap = len & 0x1F;
+
+    if (size > 0) {
+      // This is a struct with pointers using TS3 encoding
+      out.str("[Struct, size = ");
+      out.num(size);
+      if (ptr_bitmap == 0) {
+        out.str(", ptr offsets = none]");
+      } else {
+        // TS3: bitmap is shifted - bit 0 represents offset 1, etc.
+        out.str(", ptr offsets =");
+        for (int i = 0; i < 5; ++i) {
+          if (ptr_bitmap & (1 << i)) {
+            out.str(" ");
+            out.num(i + 1);
+          }
+        }
+        out.str("]");
+      }
+    } else {
+      // Not TS3: this is an atomic struct
+      // Bit 3 set: atomic struct with even fields, size = len + 1
+      // Bit 3 not set: atomic struct with odd number of fields, size = len
+      out.str("[Struct, size = ");
+      out.num((header & 0x8) ? len + 1 : len);
+      out.str(", ptr offsets = none]");
+    }
+  } else {
+    // Unknown tag
+    out.str("[Unknown tag ");
+    out.num(tag);
+    out.str(", len = ");
+    out.num(len);
+    out.str("]");
+  }
+}
+
+// print one event as text. `args` holds gc_log_arity[event] values; `message`
+// is only used by GC_EV_PANIC.
+template <class Out>
+void gc_log_format(Out &out, uint8_t event, const int64_t *args,
+                   const char *message) {
+  switch (event) {
+  case GC_EV_INIT:
+    out.str("_cflat_init_gc: allocated heap of ");
+    out.num(args[0]);
+    out.str(" words\n");
+    break;
+  case GC_EV_INIT_NURSERY:
+    out.str("_cflat_init_gc: using a nursery of ");
+    out.num(args[0]);
+    out.str(" words\n");
+    break;
+  case GC_EV_ALLOC:
+    out.str("_cflat_alloc: attempting to allocate ");
+    out.num(args[0]);
+    out.str(" words...");
+    break;
+  case GC_EV_ALLOC_RETRY:
+    out.str("_cflat_alloc: second attempt to allocate ");
+    out.num(args[0]);
+    out.str(" words...");
+    break;
+  case GC_EV_ALLOC_OK:
+    out.str("successful\n");
+    break;
+  case GC_EV_ALLOC_OLD:
+    out.str("allocated in old generation\n");
+    break;
+  case GC_EV_ALLOC_GC:
+    out.str("triggering collection\n");
+    break;
+  case GC_EV_MINOR:
+    out.str("gc: minor collection\n");
+    break;
+  case GC_EV_MAJOR:
+    out.str("gc: major collection\n");
+    break;
+  case GC_EV_FRAME:
+    out.str("gc: processing stack frame ");
+    out.num(args[0]);
+    out.str(" (from top of stack), with ");
+    out.num(args[1]);
+    out.str(" pointers\n");
+    break;
+  case GC_EV_ROOT:
+    out.str("-- processing pointer offset ");
+    out.num(args[0]);
+    out.str("\n");
+    break;
+  case GC_EV_REMSET:
+    out.str("gc: processing remembered set (");
+    out.num(args[0]);
+    out.str(" objects)\n");
+    break;
+  case GC_EV_FORWARD:
+    out.str("---- copying object at relative address ");
+    out.num(args[0]);
+    out.str(" with header [Forwarded]\n");
+    out.str("---- object forwarded to relative address ");
+    out.num(args[1]);
+    out.str("\n");
+    break;
+  case GC_EV_COPY:
+    out.str("---- copying object at relative address ");
+    out.num(args[0]);
+    out.str(" with header ");
+    gc_log_format_header(out, (uintptr_t)args[1]);
+    out.str("\n");
+    out.str("---- moving object from relative address ");
+    out.num(args[0]);
+    out.str(" to ");
+    out.num(args[2]);
+    out.str("\n");
+    break;
+  case GC_EV_SCAN:
+    out.str("gc: starting scan\n");
+    break;
+  case GC_EV_SCAN_OBJECT:
+    out.str("-- scanning header ");
+    gc_log_format_header(out, (uintptr_t)args[0]);
+    out.str("\n");
+    break;
+  case GC_EV_SCAN_NEXT:
+    out.str("-- incrementing scanning ptr by ");
+    out.num(args[0]);
+    out.str("\n");
+    break;
+  case GC_EV_PROMOTED:
+    out.str("gc: promoted ");
+    out.num(args[0]);
+    out.str(" words (");
+    out.num(args[1]);
+    out.str(" words live in old generation)\n");
+    break;
+  case GC_EV_SWAP:
+    out.str("gc: swapping from and to spaces (");
+    out.num(args[0]);
+    out.str(" words still live)\n");
+    break;
+  case GC_EV_PANIC:
+    out.str(message);
+    out.str("\n");
+    break;
+  case GC_EV_RESIZE:
+    out.str("gc: resizing heap to ");
+    out.num(args[0]);
+    out.str(" words\n");
+    break;
+  case GC_EV_ALLOC_LARGE:
+    out.str("allocated in large object space\n");
+    break;
+  case GC_EV_LARGE_SWEEP:
+    out.str("gc: freed ");
+    out.num(args[0]);
+    out.str(" large objects (");
+    out.num(args[1]);
+    out.str(" words still live)\n");
+    break;
+  case GC_EV_COMPACT:
+    out.str("gc: mark-compact collection of the whole heap\n");
+    break;
+  case GC_EV_COMPACTED:
+    out.str("gc: compacted heap (");
+    out.num(args[0]);
+    out.str(" words still live)\n");
+    break;
+  case GC_EV_COPYING:
+    out.str("gc: switching back to copying collection\n");
+    break;
+  }
+}
+
+#endif // CFLAT_GC_LOG_H
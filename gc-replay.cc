@@ -0,0 +1,432 @@
+// offline replay of allocation traces (`CFLAT_GC_TRACE`, see gc-trace.h):
+// runs the allocations, write barrier calls and deaths of a recorded program
+// again against the runtime, with any heap size and collector mode, so
+// collector changes can be compared on real programs without rerunning them.
+// each heap size is replayed in a forked child, like gc-bench, and other
+// CFLAT_GC_* variables are passed through.
+//
+// build: g++ -O2 -fno-omit-frame-pointer -o gc-replay gc-replay.cc runtime.cc -lpthread
+// usage: gc-replay [-h heap words,...] trace file
+//
+// the replay rebuilds the object graph of the recorded program: every object
+// gets its recorded size, header and initial pointer fields, the recorded
+// stores are made again through the write barrier, and the objects the roots
+// pointed to as each recorded collection started are held in the roots until
+// the next one. so are the objects allocated in between, until the next one
+// if they survived it, or else until the trace last mentions them, since the
+// program's stack isn't recorded in between. objects are found by id through
+// a directory of weak arrays, also in the roots (about one more word per live
+// object), which doesn't keep them alive, so they die when the replayed graph
+// drops them, about when they did in the recording.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "gc-harness.h"
+#include "gc-log.h"
+#include "gc-trace.h"
+
+// slots per directory chunk (a pointer array in one root); as many as it
+// takes to fit the largest live set in `MAX_CHUNKS` roots.
+static const size_t MIN_CHUNK_SLOTS = 64;
+static const size_t MAX_CHUNKS = 4096;
+
+struct trace_info {
+  uint64_t heap_words = 0;
+  uint64_t objects = 0;
+  uint64_t max_live = 0;
+  uint64_t max_roots = 0;
+  uint64_t collections = 0;
+  // (record index, object) for each object that died in the first
+  // collection after its allocation, by the index of the last record that
+  // mentions it, after which the replay lets go of it
+  std::vector<std::pair<uint64_t, uint64_t>> releases;
+};
+
+static std::vector<uint8_t> data;
+static const uint8_t *trace_start;
+
+// walk the records of the trace, calling `visit(record, fields, list)` for
+// each one, where `list` holds the objects of GC_TRACE_DEATHS and
+// GC_TRACE_ROOTS, as ids, and the pairs of field and value of the
+// allocations, one after the other. returns false, with a message, if the
+// trace is corrupt.
+template <typename Visit>
+static bool for_each_record(Visit visit) {
+  const uint8_t *in = trace_start;
+  const uint8_t *end = data.data() + data.size();
+  auto get = [&](uint64_t &value) { return gc_log_get_varint(&in, end, &value); };
+  std::vector<uint64_t> list;
+  while (in < end) {
+    uint8_t record = *in++;
+    uint64_t fields[3] = {0, 0, 0};
+    bool ok = true;
+    list.clear();
+    switch (record) {
+    case GC_TRACE_INIT:
+    case GC_TRACE_COLLECT:
+      ok = get(fields[0]);
+      break;
+    case GC_TRACE_ALLOC:
+    case GC_TRACE_ALLOC_SITE: {
+      uint64_t count = 0;
+      ok = get(fields[0]) && get(fields[1]) &&
+           (record == GC_TRACE_ALLOC || get(fields[2])) && get(count);
+      for (uint64_t i = 0; ok && i < 2 * count; ++i) {
+        uint64_t value = 0;
+        ok = get(value);
+        list.push_back(value);
+      }
+      break;
+    }
+    case GC_TRACE_BARRIER:
+      ok = get(fields[0]) && get(fields[1]) && get(fields[2]);
+      break;
+    case GC_TRACE_DEATHS:
+    case GC_TRACE_ROOTS: {
+      uint64_t count = 0, id = 0, delta = 0;
+      ok = get(count);
+      for (uint64_t i = 0; ok && i < count; ++i) {
+        ok = get(delta);
+        id += delta;
+        list.push_back(id);
+      }
+      break;
+    }
+    default:
+      fprintf(stderr, "bad record code %u at offset %zu\n", record,
+              (size_t)(in - 1 - data.data()));
+      return false;
+    }
+    if (!ok || !visit(record, fields, list)) {
+      fprintf(stderr, "truncated or corrupt trace\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// a directory of `slots` slots in `chunks` arrays of `chunk_slots` each, the
+// array of slot i being in root `first_root` + i / `chunk_slots`, or with
+// `direct`, in `chunks` roots of their own, slot i being root `first_root` + i.
+struct directory {
+  size_t first_root;
+  bool direct;
+  size_t chunk_slots;
+  size_t chunks;
+
+  directory(size_t first, size_t slots, bool in_roots = false)
+    : first_root(first),
+      direct(in_roots),
+      chunk_slots(direct ? 1 : std::max(MIN_CHUNK_SLOTS, (slots + MAX_CHUNKS - 1) / MAX_CHUNKS)),
+      chunks(direct ? slots : slots / chunk_slots + 1) {}
+  uintptr_t &chunk(size_t slot) { return gc_root(0, first_root + slot / chunk_slots); }
+  // allocate the array of `slot` if it doesn't exist yet, with `header`
+  void reserve(size_t slot, uintptr_t header) {
+    if (!direct && !chunk(slot)) {
+      chunk(slot) = (uintptr_t)gc_alloc(header, chunk_slots);
+    }
+  }
+  uintptr_t *get(size_t slot) {
+    if (direct) return (uintptr_t*)chunk(slot);
+    return (uintptr_t*)gc_load((uintptr_t*)chunk(slot), slot % chunk_slots);
+  }
+  void set(size_t slot, uintptr_t *obj) {
+    if (direct) {
+      chunk(slot) = (uintptr_t)obj;
+    } else {
+      gc_store((uintptr_t*)chunk(slot), slot % chunk_slots, (uintptr_t)obj);
+    }
+  }
+};
+
+// replay the trace in the current process, which gets one root per chunk of
+// the object directory (weak arrays, by slot), and the objects it holds in
+// the roots directly if it has room for them (or else in chunks of pointer
+// arrays).
+static void replay(const trace_info &info) {
+  directory objects(0, info.max_live);
+  bool direct = (objects.chunks + info.max_roots + 3) + 64 <= GC_HARNESS_STACK_WORDS;
+  directory roots(objects.chunks, info.max_roots, direct);
+  gc_harness_init(1, objects.chunks + roots.chunks);
+
+  static const uint32_t NO_ROOT = UINT32_MAX;
+  std::vector<uint32_t> slot_of(info.objects);
+  std::vector<uint32_t> root_of(info.objects, NO_ROOT);
+  std::vector<uint32_t> free_slots, free_roots;
+  uint32_t next_slot = 0, next_root = 0;
+  auto object = [&](uint64_t value) {
+    return value > 0 ? objects.get(slot_of[value - 1]) : nullptr;
+  };
+  auto hold = [&](uint64_t id, uintptr_t *obj) {
+    uint32_t root;
+    if (!free_roots.empty()) {
+      root = free_roots.back();
+      free_roots.pop_back();
+    } else {
+      root = next_root++;
+    }
+    roots.set(root, obj);
+    root_of[id] = root;
+  };
+  std::vector<uint64_t> held;
+
+  uint64_t next_id = 0, index = 0;
+  size_t next_release = 0;
+  for_each_record([&](uint8_t record, const uint64_t *fields,
+                      const std::vector<uint64_t> &list) {
+    switch (record) {
+    case GC_TRACE_ALLOC:
+    case GC_TRACE_ALLOC_SITE: {
+      uint32_t slot;
+      if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+      } else {
+        slot = next_slot++;
+      }
+      objects.reserve(slot, gc_header_weak(objects.chunk_slots));
+      roots.reserve(free_roots.empty() ? next_root : free_roots.back(),
+                    gc_header_ptr_array(roots.chunk_slots));
+      uintptr_t *obj = record == GC_TRACE_ALLOC
+                       ? gc_alloc(fields[1], fields[0] - 1)
+                       : gc_alloc_site(fields[1], fields[0] - 1, fields[2]);
+      objects.set(slot, obj);
+      hold(next_id, obj);
+      held.push_back(next_id);
+      slot_of[next_id++] = slot;
+      for (size_t i = 0; i < list.size(); i += 2) {
+        gc_store(obj, list[i], (uintptr_t)object(list[i + 1]));
+      }
+      break;
+    }
+    case GC_TRACE_BARRIER: {
+      uintptr_t *obj = object(fields[0] + 1);
+      if (obj) gc_store(obj, fields[1], (uintptr_t)object(fields[2]));
+      break;
+    }
+    case GC_TRACE_ROOTS:
+      for (uint64_t id : held) {
+        root_of[id] = NO_ROOT;
+      }
+      for (uint32_t root = 0; root < next_root; ++root) {
+        roots.set(root, nullptr);
+      }
+      held.clear();
+      free_roots.clear();
+      next_root = 0;
+      for (uint64_t id : list) {
+        roots.reserve(next_root, gc_header_ptr_array(roots.chunk_slots));
+        hold(id, object(id + 1));
+        held.push_back(id);
+      }
+      break;
+    case GC_TRACE_DEATHS:
+      for (uint64_t id : list) {
+        objects.set(slot_of[id], nullptr);
+        free_slots.push_back(slot_of[id]);
+      }
+      break;
+    }
+    for (; next_release < info.releases.size() &&
+           info.releases[next_release].first == index; ++next_release) {
+      uint64_t id = info.releases[next_release].second;
+      if (root_of[id] != NO_ROOT) {
+        roots.set(root_of[id], nullptr);
+        free_roots.push_back(root_of[id]);
+        root_of[id] = NO_ROOT;
+      }
+    }
+    index++;
+    return true;
+  });
+}
+
+// replay the trace with a heap of `heap_words` in a child process and print
+// its row.
+static void run_one(const trace_info &info, const std::string &heap_words) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the child's stdout only ever gets a panic message, which the parent
+    // reports on its own
+    close(fds[0]);
+    if (!freopen("/dev/null", "w", stdout)) { _exit(1); }
+    setenv("CFLAT_HEAP_WORDS", heap_words.c_str(), 1);
+    unsetenv("CFLAT_GC_TRACE");
+    auto start = std::chrono::steady_clock::now();
+    replay(info);
+    double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+    _cflat_gc_stats_t stats;
+    _cflat_gc_stats(&stats);
+    char row[256];
+    int len = snprintf(row, sizeof(row),
+                       "%12.0f %8llu %10.1f %10.1f %10.1f %14llu\n",
+                       info.objects / seconds,
+                       (unsigned long long)stats.collections,
+                       stats.p50_pause_ns / 1e3, stats.p99_pause_ns / 1e3,
+                       stats.max_pause_ns / 1e3,
+                       (unsigned long long)stats.words_copied);
+    if (write(fds[1], row, len) != len) { _exit(1); }
+    _exit(0);
+  }
+  close(fds[1]);
+  char row[256];
+  ssize_t len = read(fds[0], row, sizeof(row) - 1);
+  close(fds[0]);
+  waitpid(pid, nullptr, 0);
+  printf("%10s ", heap_words.c_str());
+  if (len > 0) {
+    row[len] = '\0';
+    fputs(row, stdout);
+  } else {
+    printf("%12s\n", "out of memory");
+  }
+}
+
+// read all of `file` into `data`; returns false on error.
+static bool read_all(FILE *file) {
+  uint8_t chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  return !ferror(file);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> heaps;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-h") == 0 && i + 1 < argc) {
+      std::string list = argv[++i];
+      size_t pos = 0;
+      while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) comma = list.size();
+        heaps.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+      }
+    } else if (!path) {
+      path = argv[i];
+    } else {
+      path = nullptr;
+      break;
+    }
+  }
+  if (!path) {
+    fprintf(stderr, "usage: %s [-h heap words,...] trace file\n", argv[0]);
+    return 2;
+  }
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+  if (!read_all(file)) {
+    perror("read");
+    return 1;
+  }
+  fclose(file);
+  if (data.size() < sizeof(GC_TRACE_MAGIC) ||
+      memcmp(data.data(), GC_TRACE_MAGIC, sizeof(GC_TRACE_MAGIC)) != 0) {
+    fprintf(stderr, "not a cflat allocation trace\n");
+    return 1;
+  }
+  trace_start = data.data() + sizeof(GC_TRACE_MAGIC);
+
+  // check the trace, size the directories and find out when the objects
+  // that died young can be let go of before replaying it
+  trace_info info;
+  uint64_t live = 0, num_roots = 0, index = 0, intervals = 0;
+  std::vector<bool> dead;
+  std::vector<uint64_t> payload_words, last_use, interval;
+  auto live_value = [&](uint64_t value) {
+    return value <= info.objects && (value == 0 || !dead[value - 1]);
+  };
+  auto use = [&](uint64_t value) {
+    if (value > 0) last_use[value - 1] = index;
+  };
+  bool ok = for_each_record([&](uint8_t record, const uint64_t *fields,
+                                const std::vector<uint64_t> &list) {
+    switch (record) {
+    case GC_TRACE_INIT:
+      info.heap_words = fields[0];
+      break;
+    case GC_TRACE_ALLOC:
+    case GC_TRACE_ALLOC_SITE:
+      if (fields[0] == 0) return false;
+      info.objects++;
+      dead.push_back(false);
+      last_use.push_back(index);
+      interval.push_back(intervals);
+      for (size_t i = 0; i < list.size(); i += 2) {
+        if (list[i] >= fields[0] - 1 || !live_value(list[i + 1])) return false;
+        use(list[i + 1]);
+      }
+      payload_words.push_back(fields[0] - 1);
+      info.max_live = std::max(info.max_live, ++live);
+      info.max_roots = std::max(info.max_roots, ++num_roots);
+      break;
+    case GC_TRACE_BARRIER:
+      if (fields[0] >= info.objects || dead[fields[0]] ||
+          fields[1] >= payload_words[fields[0]] || !live_value(fields[2])) {
+        return false;
+      }
+      use(fields[0] + 1);
+      use(fields[2]);
+      break;
+    case GC_TRACE_COLLECT:
+      info.collections++;
+      break;
+    case GC_TRACE_ROOTS:
+      for (uint64_t id : list) {
+        if (!live_value(id + 1)) return false;
+      }
+      num_roots = list.size();
+      info.max_roots = std::max(info.max_roots, num_roots);
+      intervals++;
+      break;
+    case GC_TRACE_DEATHS:
+      for (uint64_t id : list) {
+        if (id >= info.objects || dead[id]) return false;
+        dead[id] = true;
+        live--;
+        if (interval[id] + 1 == intervals) {
+          info.releases.push_back({last_use[id], id});
+        }
+      }
+      break;
+    }
+    index++;
+    return true;
+  });
+  if (!ok) return 1;
+  std::sort(info.releases.begin(), info.releases.end());
+  if (heaps.empty()) heaps.push_back(std::to_string(info.heap_words));
+
+  printf("%s: %llu objects, at most %llu live, %llu collections recorded\n",
+         path, (unsigned long long)info.objects, (unsigned long long)info.max_live,
+         (unsigned long long)info.collections);
+  printf("%10s %12s %8s %10s %10s %10s %14s\n", "heap", "allocs/s", "gcs",
+         "p50 us", "p99 us", "max us", "words copied");
+  for (const std::string &heap_words : heaps) {
+    run_one(info, heap_words);
+  }
+  return 0;
+}
@@ -0,0 +1,47 @@
+// allocation traces, shared by the runtime (runtime.cc), which records them,
+// and the offline replayer (gc-replay.cc), which runs them again against any
+// collector mode and heap size.
+//
+// with `CFLAT_GC_TRACE=1` the runtime records every allocation (its size and,
+// once the program has written them, its header and the pointer fields set
+// by then), every call to the write barrier with the field it was for and
+// the value stored, and for every collection the objects the roots pointed
+// to as it started and the objects it found dead, to the file named by
+// `CFLAT_GC_TRACE_FILE` (default `cflat-gc.trace`). objects are identified by
+// their allocation index, counting from 0, and pointer values by that index
+// + 1 (0 for null, or anything but a recorded object). fields are indexes of
+// payload words. an object's death is only seen by the first collection that
+// traces it after it became unreachable, so the trace knows its lifetime as
+// precisely as the recording run collected: a small nursery gives the young
+// objects precise ones.
+//
+// binary format: the 8 bytes of `GC_TRACE_MAGIC`, then a sequence of records.
+// each record is one byte holding its `gc_trace_record` code followed by
+// unsigned LEB128 varints (see gc-log.h), as listed below.
+
+#ifndef CFLAT_GC_TRACE_H
+#define CFLAT_GC_TRACE_H
+
+#include <cstdint>
+
+static const char GC_TRACE_MAGIC[8] = {'C', 'F', 'G', 'C', 'T', 'R', 'C', 2};
+
+// record codes. the comment after each one lists its fields.
+enum gc_trace_record : uint8_t {
+  GC_TRACE_INIT = 1,    // heap words of the recording run
+  GC_TRACE_ALLOC,       // words (header included), header, field count, then
+                        // that many pairs of field and value, for the
+                        // pointer fields that aren't null
+  GC_TRACE_ALLOC_SITE,  // words (header included), header, allocation site,
+                        // then the fields as for GC_TRACE_ALLOC
+  GC_TRACE_BARRIER,     // object, field, value
+  GC_TRACE_COLLECT,     // kind (0 minor, 1 full, 2 compacting), at the end
+                        // of a collection, followed by its deaths
+  GC_TRACE_DEATHS,      // object count, then that many objects in increasing
+                        // order, each but the first as the difference from
+                        // the one before
+  GC_TRACE_ROOTS,       // object count, then the objects the roots point to
+                        // as a collection starts, as for GC_TRACE_DEATHS
+};
+
+#endif // CFLAT_GC_TRACE_H
@@ -0,0 +1,185 @@
+// cflat runtime library ABI, for code that calls into runtime.cc directly
+// (generated code, or C/C++ glue linked into a cflat program).
+
+#ifndef CFLAT_RUNTIME_H
+#define CFLAT_RUNTIME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// the region the runtime currently bump-allocates from. `bump` is the next
+// free word and `limit` is the end of the words that may be handed out
+// without calling into the runtime. the runtime may lower `limit` (down to
+// nullptr) at any time to route every allocation through `_cflat_alloc`, e.g.
+// while the gc log is on. requests of `large` words or more always go through
+// `_cflat_alloc`, since they belong in the large object space. `prezeroed` is
+// set when every word below `limit` is already zero, so the fast path can
+// skip zeroing. the layout is part of the ABI: `bump`, `limit`, `large`, then
+// `prezeroed`. each thread has a region of its own (a thread-local allocation
+// buffer, with `CFLAT_GC_MUTATORS`), so it is accessed as thread-local data.
+struct _cflat_alloc_region_t {
+  uintptr_t *bump;
+  uintptr_t *limit;
+  size_t large;
+  bool prezeroed;
+};
+
+extern "C" thread_local _cflat_alloc_region_t _cflat_alloc_region;
+
+extern "C" void *_cflat_alloc(size_t num_words);
+
+// `_cflat_alloc` for the allocation site `site` (any id below 65536, chosen by
+// the caller). with `CFLAT_GC_PRETENURE` set (which needs
+// `CFLAT_GC_NURSERY_WORDS`) the runtime profiles how many objects from each
+// site survive a collection, and allocates the objects of sites that mostly
+// survive straight into the old generation, where minor collections don't
+// copy them again. like
+// `_cflat_alloc`, it must be called directly from a cflat frame.
+extern "C" void *_cflat_alloc_site(size_t num_words, uint64_t site);
+
+// allocate `n` objects at once, object i being `sizes[i]` words (header
+// included) like a `_cflat_alloc(sizes[i])`, and store them in `out[i]`. the
+// runtime reserves room for all of them together and zeroes them, so at most
+// one collection happens, before the first object is handed out, and either
+// every object is allocated or the program panics. the headers must all be
+// written before the next allocation. like `_cflat_alloc`, it must be called
+// directly from a cflat frame.
+extern "C" void _cflat_alloc_batch(const size_t *sizes, size_t n, void **out);
+
+// collector statistics since `_cflat_init_gc`, filled in by `_cflat_gc_stats`
+// (always recorded; `CFLAT_GC_STATS=1` also prints a summary at exit). pauses
+// are wall-clock times of whole collections, in nanoseconds, or of each of
+// the `increments` pauses in incremental mode. `survival` is
+// the average over collections of the words in use afterwards divided by
+// the words in use before, and `alloc_rate` is in words per second of
+// mutator (non-collection) time.
+struct _cflat_gc_stats_t {
+  uint64_t collections;
+  uint64_t minor_collections;
+  uint64_t full_collections;
+  uint64_t compactions;
+  uint64_t total_pause_ns;
+  uint64_t p50_pause_ns;
+  uint64_t p99_pause_ns;
+  uint64_t max_pause_ns;
+  uint64_t words_copied;
+  uint64_t objects_copied;
+  uint64_t objects_forwarded;
+  uint64_t frames_scanned;
+  uint64_t roots_scanned;
+  uint64_t words_allocated;
+  double survival;
+  double alloc_rate;
+  uint64_t increments;
+};
+
+extern "C" void _cflat_gc_stats(_cflat_gc_stats_t *stats);
+
+// run a full collection and append a snapshot of the heap it leaves to the
+// file named by `CFLAT_GC_DUMP_FILE` (see gc-dump.h), for gc-heap-summary.
+// like `_cflat_alloc`, it must be called directly from a cflat frame.
+extern "C" void _cflat_heap_dump();
+
+// weak references: an object whose header is (len << 3) | 5 has `len` fields
+// that each hold a pointer (or nullptr) that doesn't keep its target alive.
+// when a collection finds nothing else that does, it sets the field to
+// nullptr, so caches built on them give up their entries as the heap fills.
+// they are stored with the write barrier and loaded with the read barrier,
+// which makes the target live again, like any other pointer field.
+
+// pinning, for handing heap objects to native code: `_cflat_pin` keeps `obj`
+// (a program pointer, to its first data word) alive and at a fixed address
+// until `_cflat_unpin` is called with the handle it returns, which
+// `_cflat_pinned` turns back into the pointer. with plain semispaces the
+// object is pinned where it is, which costs nothing until collections copy
+// around it. in the other modes (a nursery, incremental collection, a
+// resizable heap, `CFLAT_GC_COMPACT`, `CFLAT_GC_ORDER` or
+// `CFLAT_GC_SEGREGATE`) an object that could still move is first evacuated
+// into the large object space, which never moves objects, by a full
+// collection: the program's own pointers to it are updated as usual, but use
+// the one `_cflat_pinned` returns afterwards, not one saved beforehand. there
+// `_cflat_pin` panics once the heap has switched to mark-compact if the
+// object would have to move. `_cflat_pin` must be called directly from a
+// cflat frame. handles are reused after `_cflat_unpin`.
+extern "C" int64_t _cflat_pin(void *obj);
+extern "C" void *_cflat_pinned(int64_t handle);
+extern "C" void _cflat_unpin(int64_t handle);
+
+// resize the array `obj` (a program pointer, to its first data word) to
+// `num_words` words, header included, like a `_cflat_alloc(num_words)`, and
+// return the resized array: the elements it kept are unchanged and any new
+// ones are zero. `obj` itself is resized if it was the last allocation and the
+// region has room, or if it was copied by the last resize, which leaves room
+// for it to grow by half before it has to be copied again; otherwise the
+// result is a copy and `obj` becomes garbage. any collection updates the
+// caller's roots as usual, but use the result afterwards, not `obj`. like
+// `_cflat_alloc`, it must be called directly from a cflat frame.
+extern "C" void *_cflat_realloc(void *obj, size_t num_words);
+
+// multi-threaded mutators (`CFLAT_GC_MUTATORS=1`): every thread other than
+// the one that called `_cflat_init_gc` must call `_cflat_register_thread`
+// directly from its first cflat function before it touches the heap, and
+// `_cflat_unregister_thread` from the same function once it is done with it.
+// collections stop every thread at a safepoint, which is any call into the
+// runtime that allocates. a thread that can run for long without allocating
+// must call `_cflat_safepoint` now and then (e.g. on loop back edges), and
+// one about to block outside the runtime, say on a lock or in a join, must
+// call `_cflat_park` first and `_cflat_unpark` afterwards, holding no heap
+// pointers but its roots in between. all of them must be called directly
+// from a cflat frame.
+extern "C" void _cflat_register_thread();
+extern "C" void _cflat_unregister_thread();
+extern "C" void _cflat_safepoint();
+extern "C" void _cflat_park();
+extern "C" void _cflat_unpark();
+
+// the from-space and to-space of the incremental collection in progress
+// (`CFLAT_GC_INCREMENTAL_WORDS`), or nullptrs if there is none. objects whose
+// header is in [`start`, `end`) haven't been copied yet, and those with one in
+// [`dest_start`, `dest_end`) are copies (or were allocated during the
+// collection). a pointer `p` to an object is tested as `start < p <= end`.
+struct _cflat_condemned_t {
+  uintptr_t *start;
+  uintptr_t *end;
+  uintptr_t *dest_start;
+  uintptr_t *dest_end;
+};
+
+extern "C" _cflat_condemned_t _cflat_condemned;
+
+// read barrier for incremental mode: every pointer loaded from a heap object
+// must go through `_cflat_read_barrier` before it is used or stored, which
+// returns the to-space address of the object (copying it first if needed),
+// and marks large objects live. the inline version only calls into the
+// runtime while a collection is in progress, for pointers outside to-space.
+extern "C" void *_cflat_read_barrier(void *ptr);
+
+[[gnu::always_inline]] inline void *_cflat_read_barrier_inline(void *ptr) {
+  uintptr_t *obj = (uintptr_t*)ptr;
+  if (__builtin_expect(_cflat_condemned.end != nullptr, 0) && obj &&
+      !(obj > _cflat_condemned.dest_start && obj <= _cflat_condemned.dest_end)) {
+    return _cflat_read_barrier(ptr);
+  }
+  return ptr;
+}
+
+// inline allocation fast path: bump `num_words` words out of the current
+// region and zero them (unless they already are), calling `_cflat_alloc` only when the region is
+// exhausted. since `_cflat_alloc` takes its roots from the frame of its
+// caller, this must only be inlined into functions with the cflat stack frame
+// layout (root count at -8(%rbp), roots below it).
+[[gnu::always_inline]] inline void *_cflat_alloc_inline(size_t num_words) {
+  uintptr_t *result = _cflat_alloc_region.bump;
+  if (__builtin_expect(num_words < _cflat_alloc_region.large &&
+                       result + num_words <= _cflat_alloc_region.limit, 1)) {
+    _cflat_alloc_region.bump = result + num_words;
+    if (!_cflat_alloc_region.prezeroed) {
+      memset(result, 0, num_words * sizeof(uintptr_t));
+    }
+    return result;
+  }
+  return _cflat_alloc(num_words);
+}
+
+#endif // CFLAT_RUNTIME_H